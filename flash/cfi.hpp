@@ -0,0 +1,556 @@
+#ifndef FLASH_CFI_HPP
+#define FLASH_CFI_HPP
+
+#include <cstdint>
+#include <type_traits>
+
+#include "flash_os.hpp"
+
+namespace cfi {
+    /**
+     * @brief Information about a erase region of the device
+     *
+     */
+    struct erase_region {
+        // size of a block in the region in bytes
+        uint32_t size;
+
+        // amount of blocks in the region
+        uint32_t amount;
+    };
+
+    /**
+     * @brief Geometry and timing of the device read from the
+     * cfi table. All sizes are for all the chips on the bus
+     *
+     */
+    struct geometry {
+        // total size of the device in bytes
+        uint32_t size;
+
+        // size of the write buffer in bytes. 0 when the
+        // device does not support buffered programming
+        uint32_t buffer_size;
+
+        // max timeout to program a single word in usec
+        uint32_t word_timeout;
+
+        // max timeout to program a full buffer in usec
+        uint32_t buffer_timeout;
+
+        // max timeout to erase a block in msec
+        uint32_t erase_timeout;
+
+        // amount of erase regions
+        uint32_t region_count;
+
+        // erase region layout
+        erase_region regions[max_info_sectors];
+    };
+
+    /**
+     * @brief Read a bus word from a possibly unaligned source buffer
+     *
+     * @tparam Bus
+     * @param data
+     * @return Bus
+     */
+    template <typename Bus>
+    Bus load(const uint8_t *const data) {
+        Bus value = 0;
+
+        for (uint32_t j = 0; j < sizeof(Bus); j++) {
+            value |= static_cast<Bus>(data[j]) << (j * 8);
+        }
+
+        return value;
+    }
+
+    /**
+     * @brief Bus access to a parallel flash mapped in the memory of
+     * the cpu.
+     *
+     * @tparam Bus bus width type
+     * @tparam Frequency cpu frequency used for the delay. Should be at
+     * least the real cpu frequency. A higher value only makes the
+     * delay (and the timeouts) longer
+     */
+    template <typename Bus, uint32_t Frequency = 200'000'000>
+    struct memory_io {
+        static Bus read(const uint32_t address) {
+            return *reinterpret_cast<const volatile Bus*>(address);
+        }
+
+        static void write(const uint32_t address, const Bus value) {
+            *reinterpret_cast<volatile Bus*>(address) = value;
+        }
+
+        /**
+         * @brief Write a block of data at increasing addresses. Uses
+         * LDM/STM bursts of 16 bytes when the source is word aligned. The
+         * external memory controller splits every word into bus accesses
+         * in ascending order
+         *
+         * @param address
+         * @param size multiple of the bus width
+         * @param data
+         */
+        static void burst(const uint32_t address, const uint32_t size, const uint8_t *data) {
+            volatile Bus* dst = reinterpret_cast<volatile Bus*>(address);
+            uint32_t i = 0;
+
+            // check if we can use bursts
+            if ((reinterpret_cast<uint32_t>(data) & 0x3) == 0 && (address & 0x3) == 0) {
+                const uint32_t bursts = size / 16;
+
+                for (uint32_t b = 0; b < bursts; b++) {
+                    asm volatile (
+                        "ldmia %[src]!, {r3-r6}\n"
+                        "stmia %[dst]!, {r3-r6}\n"
+                        : [src] "+r" (data), [dst] "+r" (dst)
+                        :
+                        : "r3", "r4", "r5", "r6", "memory"
+                    );
+                }
+
+                i = bursts * 16;
+            }
+
+            // copy the remaining bus words
+            for (; i < size; i += sizeof(Bus)) {
+                *dst++ = load<Bus>(data);
+                data += sizeof(Bus);
+            }
+        }
+
+        /**
+         * @brief Wait at least the amount of microseconds. Every
+         * iteration takes at least 1 cycle
+         *
+         * @param us
+         */
+        static void delay(const uint32_t us) {
+            for (uint32_t i = 0; i < us; i++) {
+                for (uint32_t j = 0; j < (Frequency / 1'000'000); j++) {
+                    asm volatile ("nop");
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Parallel NOR flash using the cfi table and the AMD/Spansion
+     * command set (command set 0x0002).
+     *
+     * @details Supports a single x16 device on a 16 bit bus or two
+     * interleaved x16 devices on a 32 bit bus. Every command is sent to
+     * all the chips on the bus at the same time. All bus accesses go
+     * through the io policy. It needs the following:
+     * - Bus read(address)
+     * - void write(address, value)
+     * - void burst(address, size, data): write data at increasing addresses
+     * - void delay(us): wait at least the amount of microseconds
+     *
+     * @tparam Bus bus width type (uint16_t or uint32_t)
+     * @tparam Io bus access policy
+     */
+    template <typename Bus, typename Io = memory_io<Bus>>
+    class flash {
+    protected:
+        static_assert(
+            std::is_same_v<Bus, uint16_t> || std::is_same_v<Bus, uint32_t>,
+            "Only 16 and 32 bit buses are supported"
+        );
+
+        // width of a single chip on the bus in bytes
+        constexpr static uint32_t chip_width = sizeof(uint16_t);
+
+        // amount of chips on the bus
+        constexpr static uint32_t chips = sizeof(Bus) / chip_width;
+
+        // command addresses (in bus words)
+        constexpr static uint32_t unlock_address0 = 0x555;
+        constexpr static uint32_t unlock_address1 = 0x2aa;
+        constexpr static uint32_t query_address = 0x55;
+
+        // status bits
+        constexpr static uint8_t dq1 = (0x1 << 1);
+        constexpr static uint8_t dq5 = (0x1 << 5);
+        constexpr static uint8_t dq7 = (0x1 << 7);
+
+        // max multiplier used when the device does not report one
+        constexpr static uint8_t default_multiplier = 4;
+
+        /**
+         * @brief Replicate a value for every chip on the bus
+         *
+         * @param value
+         * @return constexpr Bus
+         */
+        constexpr static Bus replicate(const uint16_t value) {
+            Bus ret = 0;
+
+            for (uint32_t i = 0; i < chips; i++) {
+                ret |= static_cast<Bus>(value) << (i * chip_width * 8);
+            }
+
+            return ret;
+        }
+
+        /**
+         * @brief Write a command to a bus word offset of the device
+         *
+         * @param base
+         * @param offset
+         * @param command
+         */
+        static void command(const uint32_t base, const uint32_t offset, const uint16_t command) {
+            Io::write(base + (offset * sizeof(Bus)), replicate(command));
+        }
+
+        /**
+         * @brief Send the unlock sequence to the device
+         *
+         * @param base
+         */
+        static void unlock(const uint32_t base) {
+            command(base, unlock_address0, 0xaa);
+            command(base, unlock_address1, 0x55);
+        }
+
+        /**
+         * @brief Read a byte from the cfi table of the first chip
+         *
+         * @param base
+         * @param offset
+         * @return uint8_t
+         */
+        static uint8_t query_byte(const uint32_t base, const uint32_t offset) {
+            return Io::read(base + (offset * sizeof(Bus))) & 0xff;
+        }
+
+        /**
+         * @brief Read a little endian 16 bit value from the cfi table
+         *
+         * @param base
+         * @param offset
+         * @return uint16_t
+         */
+        static uint16_t query_half(const uint32_t base, const uint32_t offset) {
+            return query_byte(base, offset) | (query_byte(base, offset + 1) << 8);
+        }
+
+        /**
+         * @brief Read a max timeout from the cfi table
+         *
+         * @param base
+         * @param typical offset of the typical time (2 ^ n)
+         * @param multiplier offset of the max multiplier (2 ^ n)
+         * @return uint32_t
+         */
+        static uint32_t query_timeout(const uint32_t base, const uint32_t typical, const uint32_t multiplier) {
+            const uint8_t max = query_byte(base, multiplier);
+
+            return (0x1 << query_byte(base, typical)) << (max ? max : default_multiplier);
+        }
+
+        /**
+         * @brief Wait until a program or erase operation is done using
+         * data polling on the last address written.
+         *
+         * @details Stops after the timeout as a protected block, a wrong bus
+         * width or a missing memory controller setup never sets DQ7 or DQ5
+         *
+         * @param address
+         * @param expected the value that should be at the address when done
+         * @param errors status bits that mark a failure of a busy chip
+         * @param timeout max time the operation can take in usec
+         * @return true when the operation is done, false on a error
+         */
+        static bool wait_ready(const uint32_t address, const Bus expected, const uint8_t errors, const uint32_t timeout) {
+            for (uint32_t elapsed = 0; elapsed <= timeout; elapsed++) {
+                // keep the watchdog happy while the device is busy
+                FeedWatchdog();
+
+                // DQ7 shows the complement of the data while busy
+                const Bus status = Io::read(address);
+                const Bus busy = (status ^ expected) & replicate(dq7);
+
+                if (!busy) {
+                    // the other bits can become valid after DQ7. Read
+                    // again to check the full value
+                    return Io::read(address) == expected;
+                }
+
+                // check every chip that is still busy for a error
+                for (uint32_t i = 0; i < chips; i++) {
+                    const uint32_t shift = i * chip_width * 8;
+
+                    if (!((busy >> shift) & dq7) || !((status >> shift) & errors)) {
+                        continue;
+                    }
+
+                    // read once more as DQ7 could have changed at the
+                    // same time as the error bits
+                    if (((Io::read(address) ^ expected) >> shift) & dq7) {
+                        return false;
+                    }
+                }
+
+                Io::delay(1);
+            }
+
+            return false;
+        }
+
+        /**
+         * @brief Program a single chunk using the write to buffer sequence.
+         * The chunk cannot cross a write buffer boundary
+         *
+         * @param base
+         * @param address
+         * @param size
+         * @param data
+         * @param info
+         * @return true on success, false on failure
+         */
+        static bool program_buffer(const uint32_t base, const uint32_t address, const uint32_t size, const uint8_t *const data, const geometry& info) {
+            unlock(base);
+
+            // write to buffer command and the amount of words (per chip) - 1
+            Io::write(address, replicate(0x25));
+            Io::write(address, replicate((size / sizeof(Bus)) - 1));
+
+            // load the data into the write buffer
+            Io::burst(address, size, data);
+
+            // confirm the write buffer
+            Io::write(address, replicate(0x29));
+
+            // wait until the last word is programmed
+            const uint32_t last = size - sizeof(Bus);
+
+            if (!wait_ready(address + last, load<Bus>(&data[last]), dq5 | dq1, info.buffer_timeout)) {
+                // write to buffer abort reset
+                unlock(base);
+                command(base, unlock_address0, 0xf0);
+
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * @brief Program a single bus word
+         *
+         * @param base
+         * @param address
+         * @param value
+         * @param info
+         * @return true on success, false on failure
+         */
+        static bool program_word(const uint32_t base, const uint32_t address, const Bus value, const geometry& info) {
+            unlock(base);
+            command(base, unlock_address0, 0xa0);
+
+            Io::write(address, value);
+
+            if (!wait_ready(address, value, dq5, info.word_timeout)) {
+                reset(base);
+
+                return false;
+            }
+
+            return true;
+        }
+
+    public:
+        /**
+         * @brief Reset the device back to read array mode
+         *
+         * @param base
+         */
+        static void reset(const uint32_t base) {
+            command(base, 0, 0xf0);
+        }
+
+        /**
+         * @brief Read the cfi table of the device
+         *
+         * @param base
+         * @param info
+         * @return true when the device has a supported cfi table
+         */
+        static bool query(const uint32_t base, geometry& info) {
+            // make sure we start in read array mode
+            reset(base);
+
+            // enter cfi query mode
+            command(base, query_address, 0x98);
+
+            // check for the "QRY" string and the AMD/Spansion command set
+            if (query_byte(base, 0x10) != 'Q' || query_byte(base, 0x11) != 'R' ||
+                query_byte(base, 0x12) != 'Y' || query_half(base, 0x13) != 0x0002)
+            {
+                reset(base);
+
+                return false;
+            }
+
+            // get the max timeouts
+            info.word_timeout = query_timeout(base, 0x1f, 0x23);
+            info.erase_timeout = query_timeout(base, 0x21, 0x25);
+
+            // a typical buffer time of 0 means no write buffer support
+            if (query_byte(base, 0x20)) {
+                info.buffer_timeout = query_timeout(base, 0x20, 0x24);
+                info.buffer_size = (0x1 << query_half(base, 0x2a)) * chips;
+            }
+            else {
+                info.buffer_timeout = 0;
+                info.buffer_size = 0;
+            }
+
+            // get the device size
+            info.size = (0x1 << query_byte(base, 0x27)) * chips;
+
+            // get the erase regions
+            info.region_count = query_byte(base, 0x2c);
+
+            if (info.region_count > max_info_sectors) {
+                reset(base);
+
+                return false;
+            }
+
+            uint32_t total = 0;
+
+            for (uint32_t i = 0; i < info.region_count; i++) {
+                const uint32_t offset = 0x2d + (i * 4);
+
+                // block size is in units of 256 bytes. 0 means 128 bytes
+                const uint32_t size = query_half(base, offset + 2);
+
+                info.regions[i] = {
+                    .size = (size ? (size * 256) : 128) * chips,
+                    .amount = static_cast<uint32_t>(query_half(base, offset)) + 1
+                };
+
+                total += info.regions[i].size * info.regions[i].amount;
+            }
+
+            // go back to read array mode
+            reset(base);
+
+            // the erase regions should cover the full device
+            return total == info.size;
+        }
+
+        /**
+         * @brief Get the size of the block at a address
+         *
+         * @param base
+         * @param address
+         * @param info
+         * @return uint32_t size of the block. 0 when the address is
+         * outside the device
+         */
+        static uint32_t block_size(const uint32_t base, const uint32_t address, const geometry& info) {
+            uint32_t offset = 0;
+
+            for (uint32_t i = 0; i < info.region_count; i++) {
+                const auto& region = info.regions[i];
+
+                offset += region.size * region.amount;
+
+                if ((address - base) < offset) {
+                    return region.size;
+                }
+            }
+
+            return 0;
+        }
+
+        /**
+         * @brief Erase the block at a address
+         *
+         * @param base
+         * @param address
+         * @param info
+         * @return true on success, false on failure
+         */
+        static bool erase(const uint32_t base, const uint32_t address, const geometry& info) {
+            // check if the address is in the device
+            if (!block_size(base, address, info)) {
+                return false;
+            }
+
+            unlock(base);
+            command(base, unlock_address0, 0x80);
+            unlock(base);
+
+            // block erase command at the block address
+            Io::write(address, replicate(0x30));
+
+            if (!wait_ready(address, static_cast<Bus>(~static_cast<Bus>(0)), dq5, info.erase_timeout * 1000)) {
+                reset(base);
+
+                return false;
+            }
+
+            return true;
+        }
+
+        /**
+         * @brief Program a range of the device. Uses the write buffer
+         * when available and falls back to word programming when not
+         *
+         * @param base
+         * @param address bus aligned address
+         * @param size multiple of the bus width
+         * @param data
+         * @param info
+         * @return true on success, false on failure
+         */
+        static bool program(const uint32_t base, uint32_t address, uint32_t size, const uint8_t *data, const geometry& info) {
+            // the device can only program full bus words
+            if ((address | size) & (sizeof(Bus) - 1)) {
+                return false;
+            }
+
+            // check if the range is in the device
+            if ((address - base) > info.size || size > (info.size - (address - base))) {
+                return false;
+            }
+
+            if (!info.buffer_size) {
+                for (uint32_t i = 0; i < size; i += sizeof(Bus)) {
+                    if (!program_word(base, address + i, load<Bus>(&data[i]), info)) {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+            while (size) {
+                // get the amount of bytes until the next buffer boundary
+                const uint32_t left = info.buffer_size - ((address - base) % info.buffer_size);
+                const uint32_t chunk = (size < left) ? size : left;
+
+                if (!program_buffer(base, address, chunk, data, info)) {
+                    return false;
+                }
+
+                address += chunk;
+                data += chunk;
+                size -= chunk;
+            }
+
+            return true;
+        }
+    };
+}
+
+#endif
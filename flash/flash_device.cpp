@@ -1,5 +1,9 @@
 #include <cstdint>
 #include "flash_os.hpp"
+#include "cfi.hpp"
+#include "read_mode.hpp"
+#include "memory.hpp"
+#include "fused.hpp"
 
 /**
  * @brief Smallest amount of data that can be programmed
@@ -17,6 +21,17 @@
  */
 #define NATIVE_READ (false)
 
+/**
+ * @brief If value is true the flash controller is switched to memory mapped
+ * mode at runtime for verify and read operations. Reads, blank checks and 
+ * the custom verify are then served directly from the memory mapped region.
+ * The controller is switched back to command mode before any erase or 
+ * program. Only used when the device does not support native read. The 
+ * controller is implemented in flash_controller below.
+ * 
+ */
+#define MEMORY_MAPPED_READ (false)
+
 /**
  * @brief Marks if the device supports a chip erase. This can speed up erasing
  * a chip.
@@ -53,6 +68,52 @@
  */
 #define RUNTIME_SECTORS (false)
 
+/**
+ * @brief If value is true the cfi backend is used for a parallel NOR flash
+ * (AMD/Spansion command set). The geometry, write buffer size and timeouts
+ * are read from the cfi table in init. Programming uses the write to buffer
+ * sequence. The bus width is set using cfi_flash below and the device type 
+ * should be set to external_16_bit or external_32_bit. The sector erase 
+ * timeout in the FlashDevice should be at least the max block erase time 
+ * of the device. When RUNTIME_SECTORS is disabled the sectors in the 
+ * FlashDevice need to match the erase regions of the device.
+ * 
+ */
+#define CFI_FLASH (false)
+
+/**
+ * @brief If value is true every page is verified against the source buffer
+ * in SEGGER_OPEN_Program while the J-Link data is still available. A 
+ * mismatch fails the program call. Verify returns the stored result for 
+ * ranges that were programmed with the same data, so the verify pass of 
+ * the J-Link does not read the flash again. Requires a custom verify.
+ * 
+ */
+#define FUSED_VERIFY (false)
+
+/**
+ * @brief Marks if a bank of the flash can be read while a page in another
+ * bank is programming. When true the fused verify checks page N while page
+ * N + 1 is programming if both pages are in different banks (see 
+ * fused_device::same_bank). Otherwise every page is checked after it is 
+ * programmed. As neighbouring pages are mostly in the same bank this only
+ * overlaps at bank boundaries, unless every page can be read while another
+ * page is programming.
+ * 
+ */
+#define READ_WHILE_PROGRAM (false)
+
+#if NATIVE_READ && MEMORY_MAPPED_READ
+    #error "MEMORY_MAPPED_READ is only supported when NATIVE_READ is disabled"
+#endif
+
+#if CFI_FLASH && !NATIVE_READ
+    #error "CFI_FLASH requires NATIVE_READ as parallel NOR flash is memory mapped"
+#endif
+
+#if FUSED_VERIFY && !CUSTOM_VERIFY
+    #error "FUSED_VERIFY requires CUSTOM_VERIFY to return the fused verify result"
+#endif
 
 /**
  * @brief Device specific infomation
@@ -174,6 +235,180 @@ const uint32_t SEGGER_OFL_Api[] __attribute__ ((section ("PrgCode"), __used__))
     reinterpret_cast<uint32_t>(RUNTIME_SECTORS_FUNC),
 };
 
+#if MEMORY_MAPPED_READ
+    /**
+     * @brief Flash controller that can switch between command mode 
+     * and memory mapped mode
+     * 
+     */
+    struct flash_controller {
+        static void command_mode() {
+            // TODO: switch the flash controller to command mode
+        }
+
+        static void memory_mapped_mode() {
+            // TODO: switch the flash controller to memory mapped mode
+        }
+
+        static bool read(const uint32_t address, const uint32_t size, uint8_t *const data) {
+            // TODO: add read implementation using commands
+
+            return true;
+        }
+
+        static const volatile uint8_t* map(const uint32_t address, const uint32_t size) {
+            return reinterpret_cast<const volatile uint8_t*>(address);
+        }
+    };
+
+    using flash_read_mode = read_mode<flash_controller>;
+#endif
+
+#if CFI_FLASH
+    /**
+     * @brief Bus width type of the parallel NOR flash. uint16_t for a x16 
+     * device and uint32_t for two interleaved x16 devices
+     * 
+     */
+    using cfi_flash = cfi::flash<uint16_t>;
+
+    /**
+     * @brief Geometry of the flash. Read from the cfi table in Init as 
+     * no startup code runs before it
+     * 
+     */
+    static cfi::geometry cfi_geometry;
+
+    #if !RUNTIME_SECTORS
+        /**
+         * @brief Check if the sectors in the FlashDevice match the erase 
+         * regions of the device
+         * 
+         * @return true when all the sectors match
+         */
+        static bool cfi_sectors_match() {
+            uint32_t offset = 0;
+
+            for (uint32_t i = 0; i < cfi_geometry.region_count; i++) {
+                const auto& region = cfi_geometry.regions[i];
+
+                // check if the sector layout of the region matches
+                if (i >= (max_sectors - 1) || FlashDevice.sectors[i].size != region.size || 
+                    FlashDevice.sectors[i].offset != offset)
+                {
+                    return false;
+                }
+
+                offset += region.size * region.amount;
+            }
+
+            return FlashDevice.sectors[cfi_geometry.region_count].size == device::end_of_sectors.size;
+        }
+    #endif
+#endif
+
+/**
+ * @brief Start programming a page. Should not wait until the page is 
+ * programmed, so the fused verify can check the previous page meanwhile
+ * 
+ * @param address 
+ * @param size 
+ * @param data 
+ * @return int 0 = OK, 1 = Failed
+ */
+static int program_page_start(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+    // TODO: implement starting a page program
+
+    return 0;
+}
+
+/**
+ * @brief Wait until the page started with program_page_start is programmed
+ * 
+ * @return int 0 = OK, 1 = Failed
+ */
+static int program_page_wait() {
+    // TODO: implement waiting for the page program
+
+    return 0;
+}
+
+#if CUSTOM_VERIFY
+    /**
+     * @brief Compare the flash against a buffer using the fastest read 
+     * that is available
+     * 
+     * @param address 
+     * @param size 
+     * @param data 
+     * @return uint32_t address + size = OK, != address + size = first 
+     * address that does not match
+     */
+    static uint32_t compare_range(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+        #if NATIVE_READ
+            return address + memory::compare(
+                reinterpret_cast<const volatile uint8_t*>(address), data, size
+            );
+        #elif MEMORY_MAPPED_READ
+            return flash_read_mode::compare(address, size, data);
+        #else
+            return memory::compare(address, size, data, [](const uint32_t a, const uint32_t s, uint8_t *const d) {
+                return SEGGER_OPEN_Read(a, s, d) >= 0;
+            });
+        #endif
+    }
+#endif
+
+#if FUSED_VERIFY
+    /**
+     * @brief Results of the fused verify. Cleared in Init as no startup
+     * code runs before it
+     * 
+     */
+    static fused::record fused_record;
+
+    /**
+     * @brief Device used by the fused verify
+     * 
+     */
+    struct fused_device {
+        constexpr static bool read_while_busy = READ_WHILE_PROGRAM;
+
+        static bool same_bank(const uint32_t a, const uint32_t b) {
+            // TODO: return false when the addresses are in different banks.
+            // Reading the bank that is programming stalls or returns status 
+            // bits
+            return true;
+        }
+
+        static bool start(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+            #if CFI_FLASH
+                // the cfi backend waits until the page is programmed
+                return !ProgramPage(address, size, data);
+            #else
+                #if MEMORY_MAPPED_READ
+                    // we cannot program while in memory mapped mode
+                    flash_read_mode::set(false);
+                #endif
+
+                return !program_page_start(address, size, data);
+            #endif
+        }
+
+        static bool wait() {
+            #if CFI_FLASH
+                return true;
+            #else
+                return !program_page_wait();
+            #endif
+        }
+
+        static uint32_t compare(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+            return compare_range(address, size, data);
+        }
+    };
+#endif
+
 void __attribute__ ((noinline)) FeedWatchdog(void) {
     // TODO: implement something to keep the watchdog happy
     return;
@@ -182,47 +417,135 @@ void __attribute__ ((noinline)) FeedWatchdog(void) {
 int __attribute__ ((noinline)) Init(const uint32_t address, const uint32_t frequency, const uint32_t function) {
     // TODO: implement init
 
+    #if CFI_FLASH
+        // read the geometry of the flash
+        if (!cfi_flash::query(FlashDevice.base_address, cfi_geometry)) {
+            return 1;
+        }
+
+        #if !RUNTIME_SECTORS
+            // make sure the J-Link uses the same blocks as the device
+            if (!cfi_sectors_match()) {
+                return 1;
+            }
+        #endif
+    #endif
+
+    #if MEMORY_MAPPED_READ
+        // switch to memory mapped mode for verify and read
+        flash_read_mode::init(function);
+    #endif
+
+    #if FUSED_VERIFY
+        // the flash is going to change. Forget the previous results
+        if (function == 1 || function == 2) {
+            fused_record.clear();
+        }
+    #endif
+
     return 0;
 }
 
 int __attribute__ ((noinline)) UnInit(const uint32_t function) {
+    #if MEMORY_MAPPED_READ
+        // leave the controller in command mode
+        flash_read_mode::set(false);
+    #endif
+
     // TODO: implement uninit
 
+    #if FUSED_VERIFY
+        // the results are only used by the verify pass directly after
+        // programming
+        if (function == 3) {
+            fused_record.clear();
+        }
+    #endif
+
+    #if CFI_FLASH
+        // leave the flash in read array mode
+        cfi_flash::reset(FlashDevice.base_address);
+    #endif
+
     return 0;
 }
 
 int __attribute__ ((noinline)) EraseSector(const uint32_t sector_address) {
-    // TODO: implement sector erase
+    #if MEMORY_MAPPED_READ
+        // we cannot erase while in memory mapped mode
+        flash_read_mode::set(false);
+    #endif
 
-    return 0;
+    #if CFI_FLASH
+        return !cfi_flash::erase(FlashDevice.base_address, sector_address, cfi_geometry);
+    #else
+        // TODO: implement sector erase
+
+        return 0;
+    #endif
 }
 
 int __attribute__ ((noinline)) ProgramPage(const uint32_t address, const uint32_t size, const uint8_t *const data) {
-    // TODO: implement program page
+    #if MEMORY_MAPPED_READ
+        // we cannot program while in memory mapped mode
+        flash_read_mode::set(false);
+    #endif
+
+    #if CFI_FLASH
+        return !cfi_flash::program(
+            FlashDevice.base_address, address, size, data, cfi_geometry
+        );
+    #else
+        // start programming the page
+        if (program_page_start(address, size, data)) {
+            return 1;
+        }
 
-    return 0;
+        return program_page_wait();
+    #endif
 }
 
 int __attribute__ ((noinline)) SEGGER_OPEN_Program(uint32_t address, uint32_t size, uint8_t *data) {
-    // get the amount of pages to write
-    const uint32_t pages = size >> PAGE_SIZE_SHIFT;
-
-    for (uint32_t i = 0; i < pages; i++) {
-        // program a page
-        int r = ProgramPage(address, (0x1 << PAGE_SIZE_SHIFT), data);
+    #if FUSED_VERIFY
+        #if CFI_FLASH
+            // use the write buffer as page size
+            const uint32_t page_size = cfi_geometry.buffer_size ? 
+                cfi_geometry.buffer_size : (0x1 << PAGE_SIZE_SHIFT);
+        #else
+            const uint32_t page_size = (0x1 << PAGE_SIZE_SHIFT);
+        #endif
+
+        // program and verify in a single pass. A mismatch fails the 
+        // program. The api can only return 0 or 1 here, the first 
+        // mismatching address is returned by Verify
+        return fused::program<fused_device>(
+            address, size, data, page_size, fused_record
+        ) != fused::status::ok;
+    #elif CFI_FLASH
+        // program the full range at once so the write buffer is not 
+        // limited by the page size
+        return ProgramPage(address, size, data);
+    #else
+        // get the amount of pages to write
+        const uint32_t pages = size >> PAGE_SIZE_SHIFT;
+
+        for (uint32_t i = 0; i < pages; i++) {
+            // program a page
+            int r = ProgramPage(address, (0x1 << PAGE_SIZE_SHIFT), data);
+
+            // check if something went wrong
+            if (r) {
+                // return a error
+                return 1;
+            }
 
-        // check if something went wrong
-        if (r) {
-            // return a error
-            return 1;
+            address += (0x1 << PAGE_SIZE_SHIFT);
+            data += (0x1 << PAGE_SIZE_SHIFT);
         }
 
-        address += (0x1 << PAGE_SIZE_SHIFT);
-        data += (0x1 << PAGE_SIZE_SHIFT);
-    }
-
-    // return everything went oke
-    return 0;
+        // return everything went oke
+        return 0;
+    #endif
 }
 
 #if CHIP_ERASE == true
@@ -248,7 +571,14 @@ int __attribute__ ((noinline)) SEGGER_OPEN_Program(uint32_t address, uint32_t si
             }
 
             // go to the next sector address
-            SectorAddr += (1 << SECTOR_SIZE_SHIFT);
+            #if CFI_FLASH
+                // the blocks of the device are not uniform in size
+                SectorAddr += cfi_flash::block_size(
+                    FlashDevice.base_address, SectorAddr, cfi_geometry
+                );
+            #else
+                SectorAddr += (1 << SECTOR_SIZE_SHIFT);
+            #endif
         }
 
         // return everything went oke
@@ -258,21 +588,41 @@ int __attribute__ ((noinline)) SEGGER_OPEN_Program(uint32_t address, uint32_t si
 
 #if CUSTOM_VERIFY
     uint32_t __attribute__ ((noinline, __used__)) Verify(uint32_t Addr, uint32_t NumBytes, uint8_t *pBuff) {
-        // TODO: implement verify
+        #if FUSED_VERIFY
+            uint32_t result;
 
-        return (Addr + NumBytes);
+            // use the result of the fused verify when it covers the range
+            // and the flash was programmed with the same data
+            if (fused_record.check(Addr, NumBytes, pBuff, result)) {
+                return result;
+            }
+        #endif
+
+        return compare_range(Addr, NumBytes, pBuff);
     }
 #endif
 
 #if !NATIVE_READ
     int __attribute__ ((noinline, __used__)) BlankCheck(const uint32_t address, const uint32_t size, const uint8_t blank_value) {
-        // TODO: implement blank check
-
-        return 0;
+        #if MEMORY_MAPPED_READ
+            // check using the current mode of the controller
+            return !flash_read_mode::blank(address, size, blank_value);
+        #else
+            // TODO: implement blank check
+
+            return 0;
+        #endif
     }
 
     int __attribute__ ((noinline, __used__)) SEGGER_OPEN_Read(const uint32_t address, const uint32_t size, uint8_t *const data) {
-        // TODO: add read implementation
+        #if MEMORY_MAPPED_READ
+            // read using the current mode of the controller
+            if (!flash_read_mode::read(address, size, data)) {
+                return -1;
+            }
+        #else
+            // TODO: add read implementation
+        #endif
 
         return size;
     }
@@ -280,24 +630,43 @@ int __attribute__ ((noinline)) SEGGER_OPEN_Program(uint32_t address, uint32_t si
 
 #if RUNTIME_SECTORS
     int __attribute__ ((noinline, __used__)) SEGGER_OPEN_GetFlashInfo(flash_info *const info, uint32_t InfoAreaSize) {
-        // set the sector count (max is 7)
-        info->count = max_info_sectors;
-
-        // set the flash data
-        for (uint32_t i = 0; i < info->count; i++) {
-            // set every sector (we need to update every sector 
-            // we want to use as the data is not filled in)
-            info->sectors[i] = {
-                // set the start offset for the current sector
-                .offset = i * 0x100,
-                
-                // set the sector size
-                .size = 0x100,
-
-                // set the amount of sectors in the section
-                .amount = 10,
-            };
-        }
+        #if CFI_FLASH
+            uint32_t offset = 0;
+
+            // use the erase regions from the cfi table
+            info->count = cfi_geometry.region_count;
+
+            for (uint32_t i = 0; i < info->count; i++) {
+                const auto& region = cfi_geometry.regions[i];
+
+                info->sectors[i] = {
+                    .offset = offset,
+                    .size = region.size,
+                    .amount = region.amount,
+                };
+
+                offset += region.size * region.amount;
+            }
+        #else
+            // set the sector count (max is 7)
+            info->count = max_info_sectors;
+
+            // set the flash data
+            for (uint32_t i = 0; i < info->count; i++) {
+                // set every sector (we need to update every sector 
+                // we want to use as the data is not filled in)
+                info->sectors[i] = {
+                    // set the start offset for the current sector
+                    .offset = i * 0x100,
+                    
+                    // set the sector size
+                    .size = 0x100,
+
+                    // set the amount of sectors in the section
+                    .amount = 10,
+                };
+            }
+        #endif
 
         return 0;
     }
@@ -226,11 +226,15 @@ extern "C" {
     int SEGGER_OPEN_Read(uint32_t Addr, uint32_t NumBytes, uint8_t *pDestBuff);
 
     /**
-     * @brief Programs multiple pages at once in 1 ramcode call. Speeds up programming. 
-     * 
-     * @param DestAddr 
-     * @param NumBytes 
-     * @param pSrcBuff 
+     * @brief Programs multiple pages at once in 1 ramcode call. Speeds up programming.
+     *
+     * @note The J-Link only accepts 0 or 1 here, there is no way to return a
+     * address. The fused verify returns 1 on a mismatch and reports the first
+     * mismatching address using the return value of Verify.
+     *
+     * @param DestAddr
+     * @param NumBytes
+     * @param pSrcBuff
      * @return int 0 = OK, 1 = Failed
      */
     int SEGGER_OPEN_Program(uint32_t DestAddr, uint32_t NumBytes, uint8_t *pSrcBuff);
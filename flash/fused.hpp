@@ -0,0 +1,283 @@
+#ifndef FLASH_FUSED_HPP
+#define FLASH_FUSED_HPP
+
+#include <cstdint>
+
+namespace fused {
+    /**
+     * @brief Result of a fused program and verify
+     *
+     */
+    enum class status {
+        // everything is programmed and matches the source data
+        ok,
+
+        // everything is programmed but the flash does not match
+        mismatch,
+
+        // the device returned a program error
+        error
+    };
+
+    /**
+     * @brief Get the checksum of a buffer (FNV-1a on 32 bit words). Does
+     * not need a table and is cheaper than reading the flash again
+     *
+     * @param data
+     * @param size
+     * @return uint32_t
+     */
+    inline uint32_t checksum(const uint8_t *const data, const uint32_t size) {
+        constexpr uint32_t prime = 0x01000193;
+        uint32_t hash = 0x811c9dc5;
+        uint32_t i = 0;
+
+        // build the words from bytes so the source does not need to be aligned
+        for (; (i + sizeof(uint32_t)) <= size; i += sizeof(uint32_t)) {
+            const uint32_t word = (
+                static_cast<uint32_t>(data[i]) | (static_cast<uint32_t>(data[i + 1]) << 8) |
+                (static_cast<uint32_t>(data[i + 2]) << 16) | (static_cast<uint32_t>(data[i + 3]) << 24)
+            );
+
+            hash = (hash ^ word) * prime;
+        }
+
+        for (; i < size; i++) {
+            hash = (hash ^ data[i]) * prime;
+        }
+
+        return hash;
+    }
+
+    /**
+     * @brief Record of the ranges checked by the fused verify. Used to
+     * answer the verify pass of the J-Link without reading the flash again.
+     *
+     * @details As no startup code runs the record can contain garbage or a
+     * valid record of a previous session. It is only used when the marker
+     * is valid and the checksum of the data to verify matches the checksum
+     * of the data that was programmed. Every entry is a single program call
+     * with the first mismatch in it. A verify is answered when it starts at
+     * a entry and covers complete consecutive entries
+     */
+    struct record {
+        // marker to check if the record was cleared at least once
+        constexpr static uint32_t magic = 0x46555345;
+
+        // amount of program calls that are stored
+        constexpr static uint32_t max_entries = 8;
+
+        /**
+         * @brief A range that is programmed and verified
+         *
+         */
+        struct entry {
+            uint32_t start;
+            uint32_t end;
+
+            // checksum of the source data
+            uint32_t checksum;
+
+            // end = OK, != end = first address that did not match
+            uint32_t result;
+        };
+
+        uint32_t marker;
+        uint32_t count;
+        entry entries[max_entries];
+
+        /**
+         * @brief Clear the record
+         *
+         */
+        void clear() {
+            marker = magic;
+            count = 0;
+        }
+
+        /**
+         * @brief Check if the record can be used
+         *
+         * @return true when the record is cleared at least once
+         */
+        bool valid() const {
+            return marker == magic && count <= max_entries;
+        }
+
+        /**
+         * @brief Remove all the entries that overlap with a range
+         *
+         * @param address
+         * @param size
+         */
+        void remove(const uint32_t address, const uint32_t size) {
+            if (!valid()) {
+                clear();
+            }
+
+            uint32_t used = 0;
+
+            for (uint32_t i = 0; i < count; i++) {
+                if (entries[i].end <= address || entries[i].start >= (address + size)) {
+                    entries[used++] = entries[i];
+                }
+            }
+
+            count = used;
+        }
+
+        /**
+         * @brief Add the result of a verify to the record. Replaces the
+         * oldest entry when the record is full
+         *
+         * @param address
+         * @param size
+         * @param data source data that is programmed
+         * @param result address + size = OK, != address + size = first
+         * address that does not match
+         */
+        void add(const uint32_t address, const uint32_t size, const uint8_t *const data, const uint32_t result) {
+            remove(address, size);
+
+            if (count == max_entries) {
+                for (uint32_t i = 1; i < count; i++) {
+                    entries[i - 1] = entries[i];
+                }
+
+                count--;
+            }
+
+            entries[count++] = {
+                .start = address,
+                .end = address + size,
+                .checksum = fused::checksum(data, size),
+                .result = result
+            };
+        }
+
+        /**
+         * @brief Get the verify result for a range
+         *
+         * @param address
+         * @param size
+         * @param data data to verify against
+         * @param result address + size = OK, != address + size = first
+         * address that does not match
+         * @return true when the result for the full range is known from the
+         * fused verify, false when the range still needs to be verified
+         */
+        bool check(const uint32_t address, const uint32_t size, const uint8_t *const data, uint32_t& result) const {
+            if (!valid() || !size) {
+                return false;
+            }
+
+            uint32_t current = address;
+
+            while (current != (address + size)) {
+                const entry* found = nullptr;
+
+                for (uint32_t i = 0; i < count; i++) {
+                    if (entries[i].start == current && entries[i].end <= (address + size)) {
+                        found = &entries[i];
+                        break;
+                    }
+                }
+
+                // the range is not (fully) programmed with the same data
+                if (!found || found->checksum != fused::checksum(
+                    &data[current - address], found->end - found->start))
+                {
+                    return false;
+                }
+
+                // only the first mismatch of a entry is known
+                if (found->result != found->end) {
+                    result = found->result;
+
+                    return true;
+                }
+
+                current = found->end;
+            }
+
+            result = address + size;
+
+            return true;
+        }
+    };
+
+    /**
+     * @brief Program a range page by page and verify every page against
+     * the source buffer.
+     *
+     * @details When the device can read page N while page N + 1 is
+     * programming page N is compared while page N + 1 is programming.
+     * Otherwise the page is compared before the next page is started. The
+     * device policy needs the following:
+     * - constexpr static bool read_while_busy: true when a page can be
+     *   read while a page in another bank is programming
+     * - bool same_bank(a, b): true when both addresses are in the same
+     *   bank and cannot be read while the other is programming
+     * - bool start(address, size, data): start programming a page
+     * - bool wait(): wait until the page is programmed
+     * - uint32_t compare(address, size, data): address + size = OK,
+     *   != address + size = first address that does not match
+     *
+     * @tparam Device
+     * @param address
+     * @param size
+     * @param data
+     * @param page_size
+     * @param verified record the verify result is added to
+     * @return status
+     */
+    template <typename Device>
+    status program(const uint32_t address, const uint32_t size, const uint8_t *const data, const uint32_t page_size, record& verified) {
+        // the flash in the range is going to change
+        verified.remove(address, size);
+
+        // first address that did not match
+        uint32_t result = address + size;
+
+        if (size && !Device::start(address, (size > page_size) ? page_size : size, data)) {
+            return status::error;
+        }
+
+        for (uint32_t offset = 0; offset < size; offset += page_size) {
+            const uint32_t count = ((size - offset) > page_size) ? page_size : (size - offset);
+
+            if (!Device::wait()) {
+                return status::error;
+            }
+
+            const uint32_t next = offset + count;
+            const uint32_t next_count = ((size - next) > page_size) ? page_size : (size - next);
+
+            // start the next page before we verify the current one when
+            // the current page can be read while it is programming
+            const bool overlap = Device::read_while_busy && next < size &&
+                !Device::same_bank(address + offset, address + next);
+
+            if (overlap && !Device::start(address + next, next_count, &data[next])) {
+                return status::error;
+            }
+
+            // verify the page while we still have the source data
+            const uint32_t compared = Device::compare(address + offset, count, &data[offset]);
+
+            if (result == (address + size) && compared != (address + offset + count)) {
+                result = compared;
+            }
+
+            if (!overlap && next < size && !Device::start(address + next, next_count, &data[next])) {
+                return status::error;
+            }
+        }
+
+        verified.add(address, size, data, result);
+
+        return (result == (address + size)) ? status::ok : status::mismatch;
+    }
+}
+
+#endif
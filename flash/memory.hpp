@@ -0,0 +1,172 @@
+#ifndef FLASH_MEMORY_HPP
+#define FLASH_MEMORY_HPP
+
+#include <cstdint>
+
+namespace memory {
+    /**
+     * @brief Check if two pointers are both word aligned
+     *
+     * @param a
+     * @param b
+     * @return true when both pointers are word aligned
+     */
+    inline bool aligned(const volatile void *const a, const volatile void *const b) {
+        return ((reinterpret_cast<uintptr_t>(a) | reinterpret_cast<uintptr_t>(b)) & 0x3) == 0;
+    }
+
+    /**
+     * @brief Copy data from memory mapped flash. Uses word reads when
+     * both pointers are word aligned
+     *
+     * @param data
+     * @param flash
+     * @param size
+     */
+    inline void read(uint8_t *const data, const volatile uint8_t *const flash, const uint32_t size) {
+        uint32_t i = 0;
+
+        // check if we can copy using words
+        if (aligned(data, flash)) {
+            for (; (i + sizeof(uint32_t)) <= size; i += sizeof(uint32_t)) {
+                *reinterpret_cast<uint32_t*>(&data[i]) = (
+                    *reinterpret_cast<const volatile uint32_t*>(&flash[i])
+                );
+            }
+        }
+
+        // copy the remaining bytes
+        for (; i < size; i++) {
+            data[i] = flash[i];
+        }
+    }
+
+    /**
+     * @brief Compare memory mapped flash against a buffer. Uses word
+     * reads when both pointers are word aligned
+     *
+     * @param flash
+     * @param data
+     * @param size
+     * @return uint32_t offset of the first byte that does not match.
+     * size when everything matches
+     */
+    inline uint32_t compare(const volatile uint8_t *const flash, const uint8_t *const data, const uint32_t size) {
+        uint32_t i = 0;
+
+        // skip all the words that match
+        if (aligned(data, flash)) {
+            for (; (i + sizeof(uint32_t)) <= size; i += sizeof(uint32_t)) {
+                if (*reinterpret_cast<const volatile uint32_t*>(&flash[i]) !=
+                    *reinterpret_cast<const uint32_t*>(&data[i]))
+                {
+                    break;
+                }
+            }
+        }
+
+        // find the exact byte that does not match
+        for (; i < size; i++) {
+            if (flash[i] != data[i]) {
+                return i;
+            }
+        }
+
+        return size;
+    }
+
+    /**
+     * @brief Check if memory mapped flash only contains the blank value.
+     * Uses word reads when the pointer is word aligned
+     *
+     * @param flash
+     * @param size
+     * @param value
+     * @return true when the full range is blank
+     */
+    inline bool blank(const volatile uint8_t *const flash, const uint32_t size, const uint8_t value) {
+        const uint32_t word = static_cast<uint32_t>(value) * 0x01010101;
+        uint32_t i = 0;
+
+        if (aligned(flash, flash)) {
+            for (; (i + sizeof(uint32_t)) <= size; i += sizeof(uint32_t)) {
+                if (*reinterpret_cast<const volatile uint32_t*>(&flash[i]) != word) {
+                    return false;
+                }
+            }
+        }
+
+        // check the remaining bytes
+        for (; i < size; i++) {
+            if (flash[i] != value) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Compare flash that is not memory mapped against a buffer.
+     * The flash is read back in small chunks on the stack
+     *
+     * @tparam Read callable with the signature bool(address, size, buffer)
+     * @param address
+     * @param size
+     * @param data
+     * @param read
+     * @return uint32_t address + size = OK, != address + size = first
+     * address that does not match (or could not be read)
+     */
+    template <typename Read>
+    uint32_t compare(const uint32_t address, const uint32_t size, const uint8_t *const data, Read&& read) {
+        // small buffer on the stack to read back the flash
+        alignas(uint32_t) uint8_t buffer[32];
+
+        for (uint32_t i = 0; i < size; i += sizeof(buffer)) {
+            const uint32_t count = ((size - i) > sizeof(buffer)) ? sizeof(buffer) : (size - i);
+
+            // read back a part of the range
+            if (!read(address + i, count, buffer)) {
+                return address + i;
+            }
+
+            const uint32_t offset = compare(buffer, &data[i], count);
+
+            if (offset != count) {
+                return address + i + offset;
+            }
+        }
+
+        return address + size;
+    }
+
+    /**
+     * @brief Check if flash that is not memory mapped only contains the
+     * blank value. The flash is read back in small chunks on the stack
+     *
+     * @tparam Read callable with the signature bool(address, size, buffer)
+     * @param address
+     * @param size
+     * @param value
+     * @param read
+     * @return true when the full range is blank
+     */
+    template <typename Read>
+    bool blank(const uint32_t address, const uint32_t size, const uint8_t value, Read&& read) {
+        // small buffer on the stack to read back the flash
+        alignas(uint32_t) uint8_t buffer[32];
+
+        for (uint32_t i = 0; i < size; i += sizeof(buffer)) {
+            const uint32_t count = ((size - i) > sizeof(buffer)) ? sizeof(buffer) : (size - i);
+
+            if (!read(address + i, count, buffer) || !blank(buffer, count, value)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef FLASH_READ_MODE_HPP
+#define FLASH_READ_MODE_HPP
+
+#include <cstdint>
+
+#include "memory.hpp"
+
+/**
+ * @brief Runtime switch between command mode and memory mapped mode of
+ * a flash controller (e.g. a QSPI controller).
+ *
+ * @details Reads, compares and blank checks are served with direct
+ * memory accesses while the controller is memory mapped and with
+ * commands otherwise. The controller policy needs the following:
+ * - void command_mode(): switch the controller to command mode
+ * - void memory_mapped_mode(): switch the controller to memory mapped mode
+ * - bool read(address, size, data): read using commands
+ * - const volatile uint8_t* map(address, size): get a pointer to a range
+ *   of the memory mapped flash
+ *
+ * @tparam Controller
+ */
+template <typename Controller>
+class read_mode {
+protected:
+    // flag if the controller is in memory mapped mode. Set at
+    // runtime in init as no startup code runs before it
+    static inline bool mapped;
+
+    /**
+     * @brief Read using commands
+     *
+     * @param address
+     * @param size
+     * @param data
+     * @return true on success, false on failure
+     */
+    static bool command_read(const uint32_t address, const uint32_t size, uint8_t *const data) {
+        return Controller::read(address, size, data);
+    }
+
+public:
+    /**
+     * @brief Put the controller in the correct mode for a init function
+     *
+     * @param function function code. (1 - Erase, 2 = Program, 3 = Verify)
+     */
+    static void init(const uint32_t function) {
+        // always switch to command mode. A previous session might have
+        // been aborted without uninit leaving the controller memory mapped
+        Controller::command_mode();
+        mapped = false;
+
+        // switch to memory mapped mode when we are not going to erase
+        // or program (verify or read)
+        if (function != 1 && function != 2) {
+            set(true);
+        }
+    }
+
+    /**
+     * @brief Switch between command mode and memory mapped mode. Does
+     * nothing if the controller is already in the requested mode
+     *
+     * @param enable
+     */
+    static void set(const bool enable) {
+        // check if we need to change anything
+        if (mapped == enable) {
+            return;
+        }
+
+        if (enable) {
+            Controller::memory_mapped_mode();
+        }
+        else {
+            Controller::command_mode();
+        }
+
+        mapped = enable;
+    }
+
+    /**
+     * @brief Returns if the controller is in memory mapped mode
+     *
+     * @return true
+     * @return false
+     */
+    static bool is_mapped() {
+        return mapped;
+    }
+
+    /**
+     * @brief Read from the flash
+     *
+     * @param address
+     * @param size
+     * @param data
+     * @return true on success, false on failure
+     */
+    static bool read(const uint32_t address, const uint32_t size, uint8_t *const data) {
+        if (!mapped) {
+            return command_read(address, size, data);
+        }
+
+        memory::read(data, Controller::map(address, size), size);
+
+        return true;
+    }
+
+    /**
+     * @brief Compare the flash against a buffer
+     *
+     * @param address
+     * @param size
+     * @param data
+     * @return uint32_t address + size = OK, != address + size = first
+     * address that does not match
+     */
+    static uint32_t compare(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+        if (!mapped) {
+            return memory::compare(address, size, data, command_read);
+        }
+
+        return address + memory::compare(Controller::map(address, size), data, size);
+    }
+
+    /**
+     * @brief Check if the flash only contains the blank value
+     *
+     * @param address
+     * @param size
+     * @param value
+     * @return true when the full range is blank
+     */
+    static bool blank(const uint32_t address, const uint32_t size, const uint8_t value) {
+        if (!mapped) {
+            return memory::blank(address, size, value, command_read);
+        }
+
+        return memory::blank(Controller::map(address, size), size, value);
+    }
+};
+
+#endif
@@ -0,0 +1,615 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "cfi.hpp"
+#include "test.hpp"
+
+extern "C" void FeedWatchdog() {
+    // nothing to do on the host
+}
+
+/**
+ * @brief Simulated AMD/Spansion command set parallel NOR flash with a cfi
+ * table. Models x16 chips on a 16 bit bus or two interleaved x16 chips on
+ * a 32 bit bus. Every command needs to be sent to all the chips.
+ *
+ * @details Timing model (in nanoseconds):
+ * - every bus access takes 100 ns
+ * - a word program takes 60 us
+ * - a buffer program takes 100 us + 0.5 us for every word in the buffer
+ * - a block erase takes 400 ms
+ * - a program or erase on a protected block returns to read array mode
+ *   right away without changing anything and without setting DQ5
+ *
+ * @tparam Bus
+ */
+template <typename Bus>
+struct sim_flash {
+    constexpr static uint32_t base = 0x60000000;
+    constexpr static uint32_t chips = sizeof(Bus) / sizeof(uint16_t);
+
+    // layout per chip. 8 blocks of 8 KiB and 15 blocks of 64 KiB
+    constexpr static uint32_t chip_size = 1024 * 1024;
+    constexpr static uint32_t small_blocks = 8;
+    constexpr static uint32_t small_size = 8 * 1024;
+    constexpr static uint32_t large_blocks = 15;
+    constexpr static uint32_t large_size = 64 * 1024;
+    constexpr static uint32_t chip_buffer_size = 512;
+
+    // timing
+    constexpr static uint64_t access_time = 100;
+    constexpr static uint64_t word_time = 60'000;
+    constexpr static uint64_t buffer_time = 100'000;
+    constexpr static uint64_t buffer_word_time = 500;
+    constexpr static uint64_t erase_time = 400'000'000;
+
+    enum class state {
+        array, unlock1, unlock2, query, program, buffer_count,
+        buffer_data, buffer_confirm, erase_setup, erase_unlock1,
+        erase_unlock2
+    };
+
+    // configuration of the simulation
+    static inline bool write_buffer;
+    static inline bool connected;
+    static inline std::vector<bool> protection;
+
+    static inline std::vector<Bus> memory;
+    static inline state current;
+    static inline uint64_t time;
+    static inline uint64_t ready;
+    static inline Bus busy_value;
+
+    // write buffer state
+    static inline uint32_t buffer_block;
+    static inline uint32_t buffer_start;
+    static inline uint32_t buffer_count;
+    static inline std::vector<std::pair<uint32_t, Bus>> buffer;
+
+    // statistics
+    static inline uint32_t errors;
+    static inline uint32_t word_programs;
+    static inline uint32_t buffer_programs;
+    static inline uint32_t erases;
+
+    /**
+     * @brief Reset the simulation to a erased device
+     *
+     * @param buffered
+     */
+    static void reset(const bool buffered) {
+        write_buffer = buffered;
+        connected = true;
+        protection.assign(small_blocks + large_blocks, false);
+        memory.assign(chip_size / sizeof(uint16_t), static_cast<Bus>(~static_cast<Bus>(0)));
+        current = state::array;
+        time = 0;
+        ready = 0;
+        errors = 0;
+        word_programs = 0;
+        buffer_programs = 0;
+        erases = 0;
+    }
+
+    /**
+     * @brief Get the block index of a bus word offset
+     *
+     * @param offset
+     * @return uint32_t
+     */
+    static uint32_t block(const uint32_t offset) {
+        const uint32_t address = offset * sizeof(uint16_t);
+
+        if (address < (small_blocks * small_size)) {
+            return address / small_size;
+        }
+
+        return small_blocks + ((address - (small_blocks * small_size)) / large_size);
+    }
+
+    /**
+     * @brief Get the first bus word offset and the amount of words of a block
+     *
+     * @param index
+     * @return std::pair<uint32_t, uint32_t>
+     */
+    static std::pair<uint32_t, uint32_t> block_range(const uint32_t index) {
+        if (index < small_blocks) {
+            return {(index * small_size) / sizeof(uint16_t), small_size / sizeof(uint16_t)};
+        }
+
+        return {
+            ((small_blocks * small_size) + ((index - small_blocks) * large_size)) / sizeof(uint16_t),
+            large_size / sizeof(uint16_t)
+        };
+    }
+
+    /**
+     * @brief Get the command value that is sent to all the chips. Marks a
+     * error when the chips get different values
+     *
+     * @param value
+     * @return uint16_t
+     */
+    static uint16_t lane(const Bus value) {
+        const uint16_t first = value & 0xffff;
+
+        for (uint32_t i = 1; i < chips; i++) {
+            if (((value >> (i * 16)) & 0xffff) != first) {
+                errors++;
+            }
+        }
+
+        return first;
+    }
+
+    /**
+     * @brief Get the cfi table value for all the chips
+     *
+     * @param offset
+     * @return Bus
+     */
+    static Bus query(const uint32_t offset) {
+        uint16_t value = 0;
+
+        switch (offset) {
+            case 0x10: value = 'Q'; break;
+            case 0x11: value = 'R'; break;
+            case 0x12: value = 'Y'; break;
+            case 0x13: value = 0x02; break;
+            case 0x14: value = 0x00; break;
+            // typical word program 2 ^ 6 = 64 us, buffer 2 ^ 8 = 256 us
+            case 0x1f: value = 6; break;
+            case 0x20: value = write_buffer ? 8 : 0; break;
+            // typical block erase 2 ^ 9 = 512 ms
+            case 0x21: value = 9; break;
+            // max multipliers 2 ^ 2
+            case 0x23: value = 2; break;
+            case 0x24: value = write_buffer ? 2 : 0; break;
+            case 0x25: value = 2; break;
+            // device size 2 ^ 20
+            case 0x27: value = 20; break;
+            // write buffer size 2 ^ 9
+            case 0x2a: value = write_buffer ? 9 : 0; break;
+            case 0x2b: value = 0; break;
+            case 0x2c: value = 2; break;
+            case 0x2d: value = (small_blocks - 1) & 0xff; break;
+            case 0x2e: value = (small_blocks - 1) >> 8; break;
+            case 0x2f: value = (small_size / 256) & 0xff; break;
+            case 0x30: value = (small_size / 256) >> 8; break;
+            case 0x31: value = (large_blocks - 1) & 0xff; break;
+            case 0x32: value = (large_blocks - 1) >> 8; break;
+            case 0x33: value = (large_size / 256) & 0xff; break;
+            case 0x34: value = (large_size / 256) >> 8; break;
+        }
+
+        Bus ret = 0;
+
+        for (uint32_t i = 0; i < chips; i++) {
+            ret |= static_cast<Bus>(value) << (i * 16);
+        }
+
+        return ret;
+    }
+
+    /**
+     * @brief Start a operation that takes some time
+     *
+     * @param duration
+     * @param value value at the polled address when done
+     */
+    static void start(const uint64_t duration, const Bus value) {
+        ready = time + duration;
+        busy_value = value;
+        current = state::array;
+    }
+
+    static void write_word(const uint32_t offset, const Bus value) {
+        // writes while busy are ignored by the device
+        if (time < ready) {
+            errors++;
+            return;
+        }
+
+        // only commands need to be the same for all the chips
+        const bool data = (current == state::program || current == state::buffer_data);
+        const uint16_t command = data ? 0 : lane(value);
+
+        switch (current) {
+            case state::array:
+            case state::query:
+                if (offset == 0x555 && command == 0xaa) {
+                    current = state::unlock1;
+                }
+                else if (offset == 0x55 && command == 0x98) {
+                    current = state::query;
+                }
+                else if (command == 0xf0) {
+                    current = state::array;
+                }
+                else {
+                    errors++;
+                }
+                break;
+            case state::unlock1:
+                current = (offset == 0x2aa && command == 0x55) ? state::unlock2 : state::array;
+                break;
+            case state::unlock2:
+                if (offset == 0x555 && command == 0xa0) {
+                    current = state::program;
+                }
+                else if (offset == 0x555 && command == 0x80) {
+                    current = state::erase_setup;
+                }
+                else if (command == 0x25 && write_buffer) {
+                    buffer_block = block(offset);
+                    current = state::buffer_count;
+                }
+                else if (offset == 0x555 && command == 0xf0) {
+                    // write to buffer abort reset
+                    current = state::array;
+                }
+                else {
+                    errors++;
+                    current = state::array;
+                }
+                break;
+            case state::program:
+                word_programs++;
+
+                if (protection[block(offset)]) {
+                    current = state::array;
+                    break;
+                }
+
+                // flash can only clear bits
+                memory[offset] &= value;
+                start(word_time, memory[offset]);
+                break;
+            case state::buffer_count:
+                buffer_count = command + 1;
+                buffer.clear();
+
+                // the buffer can not be larger than the write buffer
+                if ((buffer_count * sizeof(uint16_t)) > chip_buffer_size) {
+                    errors++;
+                }
+                current = state::buffer_data;
+                break;
+            case state::buffer_data:
+                if (buffer.empty()) {
+                    buffer_start = offset;
+                }
+
+                // all the data should be in the same write buffer page
+                // and in the block of the command
+                if ((offset / (chip_buffer_size / sizeof(uint16_t))) != (buffer_start / (chip_buffer_size / sizeof(uint16_t))) ||
+                    block(offset) != buffer_block)
+                {
+                    errors++;
+                }
+
+                buffer.push_back({offset, value});
+
+                if (buffer.size() == buffer_count) {
+                    current = state::buffer_confirm;
+                }
+                break;
+            case state::buffer_confirm:
+                if (command != 0x29 || block(offset) != buffer_block) {
+                    errors++;
+                    current = state::array;
+                    break;
+                }
+
+                buffer_programs++;
+
+                if (protection[buffer_block]) {
+                    current = state::array;
+                    break;
+                }
+
+                for (const auto& [o, v] : buffer) {
+                    memory[o] &= v;
+                }
+
+                start(buffer_time + (buffer_count * buffer_word_time), memory[buffer.back().first]);
+                break;
+            case state::erase_setup:
+                current = (offset == 0x555 && command == 0xaa) ? state::erase_unlock1 : state::array;
+                break;
+            case state::erase_unlock1:
+                current = (offset == 0x2aa && command == 0x55) ? state::erase_unlock2 : state::array;
+                break;
+            case state::erase_unlock2:
+                if (command != 0x30) {
+                    errors++;
+                    current = state::array;
+                    break;
+                }
+
+                erases++;
+
+                if (protection[block(offset)]) {
+                    current = state::array;
+                    break;
+                }
+
+                {
+                    const auto [first, amount] = block_range(block(offset));
+
+                    for (uint32_t i = 0; i < amount; i++) {
+                        memory[first + i] = static_cast<Bus>(~static_cast<Bus>(0));
+                    }
+                }
+
+                start(erase_time, static_cast<Bus>(~static_cast<Bus>(0)));
+                break;
+        }
+    }
+
+    /**
+     * @brief Io policy for the cfi backend
+     *
+     */
+    struct io {
+        static Bus read(const uint32_t address) {
+            time += access_time;
+
+            if (!connected) {
+                return static_cast<Bus>(~static_cast<Bus>(0));
+            }
+
+            const uint32_t offset = (address - base) / sizeof(Bus);
+
+            // data polling while busy. DQ7 shows the complement of
+            // the final value
+            if (time < ready) {
+                Bus dq7 = 0;
+
+                for (uint32_t i = 0; i < chips; i++) {
+                    dq7 |= static_cast<Bus>(0x80) << (i * 16);
+                }
+
+                return (~busy_value) & dq7;
+            }
+
+            if (current == state::query) {
+                return query(offset);
+            }
+
+            return memory[offset];
+        }
+
+        static void write(const uint32_t address, const Bus value) {
+            time += access_time;
+
+            if (!connected) {
+                return;
+            }
+
+            write_word((address - base) / sizeof(Bus), value);
+        }
+
+        static void burst(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+            // the memory controller splits the burst in bus accesses
+            for (uint32_t i = 0; i < size; i += sizeof(Bus)) {
+                write(address + i, cfi::load<Bus>(&data[i]));
+            }
+        }
+
+        static void delay(const uint32_t us) {
+            time += us * 1000;
+        }
+    };
+};
+
+template <typename Bus>
+struct tests {
+    using sim = sim_flash<Bus>;
+    using flash = cfi::flash<Bus, typename sim::io>;
+
+    constexpr static uint32_t chips = sim::chips;
+
+    static std::vector<uint8_t> pattern(const uint32_t size, const uint32_t seed) {
+        std::vector<uint8_t> data(size);
+
+        for (uint32_t i = 0; i < size; i++) {
+            data[i] = static_cast<uint8_t>((i * 13) + seed + (i >> 8));
+        }
+
+        return data;
+    }
+
+    static bool matches(const uint32_t address, const std::vector<uint8_t>& data) {
+        return std::memcmp(
+            reinterpret_cast<const uint8_t*>(sim::memory.data()) + (address - sim::base),
+            data.data(), data.size()
+        ) == 0;
+    }
+
+    static void test_query() {
+        sim::reset(true);
+
+        cfi::geometry info;
+        test::check(flash::query(sim::base, info));
+
+        test::check(info.size == sim::chip_size * chips);
+        test::check(info.buffer_size == sim::chip_buffer_size * chips);
+        test::check(info.word_timeout == (64 << 2));
+        test::check(info.buffer_timeout == (256 << 2));
+        test::check(info.erase_timeout == (512 << 2));
+        test::check(info.region_count == 2);
+        test::check(info.regions[0].size == sim::small_size * chips);
+        test::check(info.regions[0].amount == sim::small_blocks);
+        test::check(info.regions[1].size == sim::large_size * chips);
+        test::check(info.regions[1].amount == sim::large_blocks);
+
+        // the device should be back in read array mode
+        test::check(sim::current == sim::state::array);
+
+        // block sizes
+        test::check(flash::block_size(sim::base, sim::base, info) == sim::small_size * chips);
+        test::check(flash::block_size(sim::base, sim::base + (sim::small_blocks * sim::small_size * chips), info) == sim::large_size * chips);
+        test::check(flash::block_size(sim::base, sim::base + info.size, info) == 0);
+
+        // no write buffer
+        sim::reset(false);
+        test::check(flash::query(sim::base, info));
+        test::check(info.buffer_size == 0);
+
+        // nothing on the bus (wrong bus setup)
+        sim::reset(true);
+        sim::connected = false;
+        test::check(!flash::query(sim::base, info));
+
+        test::check(sim::errors == 0);
+    }
+
+    static void test_erase() {
+        sim::reset(true);
+
+        cfi::geometry info;
+        test::check(flash::query(sim::base, info));
+
+        // program something in the second and third small block
+        const uint32_t block = sim::small_size * chips;
+        const auto data = pattern(block * 2, 1);
+        test::check(flash::program(sim::base, sim::base + block, data.size(), data.data(), info));
+
+        // erase the second block
+        test::check(flash::erase(sim::base, sim::base + block, info));
+        test::check(matches(sim::base + block, std::vector<uint8_t>(block, 0xff)));
+        test::check(matches(sim::base + (block * 2), std::vector<uint8_t>(data.begin() + block, data.end())));
+
+        // outside the device
+        test::check(!flash::erase(sim::base, sim::base + info.size, info));
+
+        test::check(sim::errors == 0);
+    }
+
+    static void test_program() {
+        sim::reset(true);
+
+        cfi::geometry info;
+        test::check(flash::query(sim::base, info));
+
+        // start in the middle of a write buffer and cross two boundaries
+        const uint32_t address = sim::base + 0x10000 + (info.buffer_size / 2);
+        const auto data = pattern(info.buffer_size * 2, 2);
+
+        test::check(flash::program(sim::base, address, data.size(), data.data(), info));
+        test::check(matches(address, data));
+        test::check(sim::buffer_programs == 3);
+        test::check(sim::word_programs == 0);
+
+        // unaligned source buffer
+        const auto unaligned = pattern(64 + 1, 3);
+        test::check(flash::program(sim::base, sim::base + 0x20000, 64, &unaligned[1], info));
+        test::check(matches(sim::base + 0x20000, std::vector<uint8_t>(unaligned.begin() + 1, unaligned.end())));
+
+        // outside the device
+        test::check(!flash::program(sim::base, sim::base + info.size - sizeof(Bus), sizeof(Bus) * 2, data.data(), info));
+
+        // not bus aligned. Rejected before any bus access
+        const uint64_t time = sim::time;
+        test::check(!flash::program(sim::base, sim::base + 0x30000 + 1, sizeof(Bus), data.data(), info));
+        test::check(!flash::program(sim::base, sim::base + 0x30000, 1, data.data(), info));
+        test::check(!flash::program(sim::base, sim::base + 0x30000, sizeof(Bus) + 1, data.data(), info));
+        test::check(sim::time == time);
+
+        test::check(sim::errors == 0);
+
+        // fall back to word programming without a write buffer
+        sim::reset(false);
+        test::check(flash::query(sim::base, info));
+
+        test::check(flash::program(sim::base, address, data.size(), data.data(), info));
+        test::check(matches(address, data));
+        test::check(sim::buffer_programs == 0);
+        test::check(sim::word_programs == data.size() / sizeof(Bus));
+
+        test::check(sim::errors == 0);
+    }
+
+    static void test_protected() {
+        sim::reset(true);
+
+        cfi::geometry info;
+        test::check(flash::query(sim::base, info));
+
+        // program something before protecting the first block
+        const auto data = pattern(256, 4);
+        test::check(flash::program(sim::base, sim::base, data.size(), data.data(), info));
+        sim::protection[0] = true;
+
+        // the erase never finishes. It should stop after the erase timeout
+        const uint64_t start = sim::time;
+        test::check(!flash::erase(sim::base, sim::base, info));
+
+        const uint64_t elapsed = sim::time - start;
+        test::check(elapsed >= (uint64_t(info.erase_timeout) * 1'000'000));
+        test::check(elapsed < (uint64_t(info.erase_timeout) * 1'000'000 * 2));
+        test::check(matches(sim::base, data));
+
+        // programming a protected block fails
+        const auto other = pattern(256, 5);
+        test::check(!flash::program(sim::base, sim::base + 256, other.size(), other.data(), info));
+
+        // word programming a protected block fails
+        sim::reset(false);
+        sim::protection[0] = true;
+        test::check(flash::query(sim::base, info));
+        test::check(!flash::program(sim::base, sim::base, other.size(), other.data(), info));
+
+        test::check(sim::errors == 0);
+    }
+
+    /**
+     * @brief Program 64 KiB and return the simulated time in microseconds
+     *
+     * @param buffered
+     * @return uint64_t
+     */
+    static uint64_t measure(const bool buffered) {
+        sim::reset(buffered);
+
+        cfi::geometry info;
+        test::check(flash::query(sim::base, info));
+
+        const auto data = pattern(64 * 1024, 6);
+        const uint64_t start = sim::time;
+
+        test::check(flash::program(sim::base, sim::base + 0x10000, data.size(), data.data(), info));
+        test::check(matches(sim::base + 0x10000, data));
+
+        return (sim::time - start) / 1000;
+    }
+
+    static void run() {
+        test_query();
+        test_erase();
+        test_program();
+        test_protected();
+
+        const uint64_t word = measure(false);
+        const uint64_t buffer = measure(true);
+
+        std::printf(
+            "%zu bit bus, program 64 KiB: word %llu us, write buffer %llu us (%.2fx)\n",
+            sizeof(Bus) * 8, static_cast<unsigned long long>(word),
+            static_cast<unsigned long long>(buffer), static_cast<double>(word) / buffer
+        );
+
+        test::check(buffer < word);
+    }
+};
+
+int main() {
+    tests<uint16_t>::run();
+    tests<uint32_t>::run();
+
+    return test::result();
+}
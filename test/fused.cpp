@@ -0,0 +1,305 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "fused.hpp"
+#include "test.hpp"
+
+/**
+ * @brief Simulated flash that programs one page at a time in the
+ * background and can inject program failures.
+ *
+ * @details Timing model (in cpu cycles):
+ * - programming a page takes 40000 cycles and runs in the background
+ * - comparing takes 20 cycles for every byte (read and compare)
+ * Reading the bank that is programming returns 0x00 (status). When the
+ * device cannot read while busy, every read while busy returns 0x00
+ *
+ * @tparam ReadWhileBusy
+ * @tparam BankSize
+ */
+template <bool ReadWhileBusy, uint32_t BankSize>
+struct sim_device {
+    constexpr static bool read_while_busy = ReadWhileBusy;
+
+    constexpr static uint32_t base = 0x08000000;
+    constexpr static uint32_t page_size = 256;
+    constexpr static uint64_t program_time = 40'000;
+    constexpr static uint64_t compare_byte_time = 20;
+
+    static inline std::vector<uint8_t> memory;
+    static inline uint64_t time;
+
+    // page that is programming
+    static inline uint64_t ready;
+    static inline uint32_t busy_address;
+    static inline bool started;
+
+    // failure injection. Bits that end up wrong and page program errors
+    static inline std::vector<std::pair<uint32_t, uint8_t>> corrupt;
+    static inline uint32_t fail_address;
+
+    // statistics
+    static inline uint32_t errors;
+
+    static void reset() {
+        memory.assign(64 * 1024, 0xff);
+        time = 0;
+        ready = 0;
+        started = false;
+        corrupt.clear();
+        fail_address = 0;
+        errors = 0;
+    }
+
+    static bool busy() {
+        return time < ready;
+    }
+
+    static bool same_bank(const uint32_t a, const uint32_t b) {
+        return ((a - base) / BankSize) == ((b - base) / BankSize);
+    }
+
+    static bool start(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+        // the device can only program one page at the time
+        if (busy() || started) {
+            errors++;
+        }
+
+        if (address == fail_address) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < size; i++) {
+            uint8_t value = data[i];
+
+            for (const auto& [a, mask] : corrupt) {
+                if (a == (address + i)) {
+                    value ^= mask;
+                }
+            }
+
+            memory[address - base + i] = value;
+        }
+
+        busy_address = address;
+        ready = time + program_time;
+        started = true;
+
+        return true;
+    }
+
+    static bool wait() {
+        if (!started) {
+            errors++;
+        }
+
+        time = (time > ready) ? time : ready;
+        started = false;
+
+        return true;
+    }
+
+    static uint32_t compare(const uint32_t address, const uint32_t size, const uint8_t *const data) {
+        for (uint32_t i = 0; i < size; i++) {
+            time += compare_byte_time;
+
+            const bool blocked = busy() && (!read_while_busy || same_bank(address + i, busy_address));
+            const uint8_t value = blocked ? 0x00 : memory[address - base + i];
+
+            if (value != data[i]) {
+                return address + i;
+            }
+        }
+
+        return address + size;
+    }
+};
+
+static std::vector<uint8_t> pattern(const uint32_t size, const uint8_t seed = 0) {
+    std::vector<uint8_t> data(size);
+
+    for (uint32_t i = 0; i < size; i++) {
+        data[i] = static_cast<uint8_t>(0x80 | ((i * 7) + (i >> 8) + seed));
+    }
+
+    return data;
+}
+
+static void test_record() {
+    fused::record verified;
+    const auto data = pattern(0x1000);
+    const auto other = pattern(0x1000, 1);
+
+    // garbage from a previous run is never used
+    std::memset(&verified, 0xa5, sizeof(verified));
+    uint32_t result = 0;
+    test::check(!verified.check(0x1000, 0x100, data.data(), result));
+
+    verified.clear();
+    test::check(!verified.check(0x1000, 0x100, data.data(), result));
+
+    // every program call is a entry
+    verified.add(0x1000, 0x100, &data[0x000], 0x1100);
+    verified.add(0x1100, 0x100, &data[0x100], 0x1150);
+    verified.add(0x1200, 0x100, &data[0x200], 0x1300);
+
+    test::check(verified.check(0x1000, 0x100, &data[0x000], result) && result == 0x1100);
+    test::check(verified.check(0x1000, 0x300, &data[0x000], result) && result == 0x1150);
+    test::check(verified.check(0x1100, 0x200, &data[0x100], result) && result == 0x1150);
+
+    // entries after a mismatch have their own result
+    test::check(verified.check(0x1200, 0x100, &data[0x200], result) && result == 0x1300);
+
+    // ranges that do not start or end at a entry are not known
+    test::check(!verified.check(0x1080, 0x80, &data[0x080], result));
+    test::check(!verified.check(0x1000, 0x80, &data[0x000], result));
+    test::check(!verified.check(0x0f00, 0x200, &data[0x000], result));
+    test::check(!verified.check(0x1200, 0x200, &data[0x200], result));
+
+    // different data than was programmed needs to be verified again. A
+    // valid record of a previous session is not used for a other image
+    test::check(!verified.check(0x1000, 0x100, &other[0x000], result));
+    test::check(!verified.check(0x1000, 0x300, &other[0x000], result));
+
+    std::vector<uint8_t> changed(data.begin(), data.begin() + 0x100);
+    changed[0x42] ^= 0x01;
+    test::check(!verified.check(0x1000, 0x100, changed.data(), result));
+
+    // programming a overlapping range replaces the entries
+    verified.add(0x1080, 0x100, &other[0x000], 0x1180);
+    test::check(!verified.check(0x1000, 0x100, &data[0x000], result));
+    test::check(!verified.check(0x1100, 0x100, &data[0x100], result));
+    test::check(verified.check(0x1080, 0x100, &other[0x000], result) && result == 0x1180);
+    test::check(verified.check(0x1200, 0x100, &data[0x200], result) && result == 0x1300);
+
+    // the oldest entry is dropped when the record is full
+    verified.clear();
+
+    for (uint32_t i = 0; i <= fused::record::max_entries; i++) {
+        verified.add(0x1000 + (i * 0x10), 0x10, &data[i * 0x10], 0x1010 + (i * 0x10));
+    }
+
+    test::check(!verified.check(0x1000, 0x10, &data[0x00], result));
+    test::check(verified.check(0x1010, fused::record::max_entries * 0x10, &data[0x10], result));
+}
+
+template <bool ReadWhileBusy, uint32_t BankSize>
+struct tests {
+    using sim = sim_device<ReadWhileBusy, BankSize>;
+
+    static void test_program() {
+        sim::reset();
+
+        const auto data = pattern(4096);
+        fused::record verified;
+        verified.clear();
+
+        test::check(fused::program<sim>(sim::base, data.size(), data.data(), sim::page_size, verified) == fused::status::ok);
+        test::check(std::memcmp(sim::memory.data(), data.data(), data.size()) == 0);
+
+        uint32_t result = 0;
+        test::check(verified.check(sim::base, data.size(), data.data(), result) && result == sim::base + data.size());
+
+        // partial last page
+        test::check(fused::program<sim>(sim::base + 0x2000, 300, data.data(), sim::page_size, verified) == fused::status::ok);
+        test::check(verified.check(sim::base + 0x2000, 300, data.data(), result) && result == sim::base + 0x2000 + 300);
+
+        test::check(sim::errors == 0);
+    }
+
+    static void test_mismatch() {
+        sim::reset();
+
+        // inject wrong bits in the third page and in the last page
+        sim::corrupt.push_back({sim::base + (2 * sim::page_size) + 17, 0x01});
+        sim::corrupt.push_back({sim::base + (15 * sim::page_size) + 3, 0x40});
+
+        const auto data = pattern(4096);
+        fused::record verified;
+        verified.clear();
+
+        // a mismatch fails the program. All pages are still programmed
+        test::check(fused::program<sim>(sim::base, data.size(), data.data(), sim::page_size, verified) == fused::status::mismatch);
+        test::check(std::memcmp(&sim::memory[14 * sim::page_size], &data[14 * sim::page_size], sim::page_size) == 0);
+
+        // the verify pass gets the first mismatching address
+        uint32_t result = 0;
+        test::check(verified.check(sim::base, data.size(), data.data(), result) && result == sim::base + (2 * sim::page_size) + 17);
+
+        test::check(sim::errors == 0);
+    }
+
+    static void test_program_error() {
+        sim::reset();
+        sim::fail_address = sim::base + (4 * sim::page_size);
+
+        const auto data = pattern(4096);
+        fused::record verified;
+        verified.clear();
+
+        // a previous result for the range is not used after a failure
+        verified.add(sim::base, data.size(), data.data(), sim::base + data.size());
+
+        test::check(fused::program<sim>(sim::base, data.size(), data.data(), sim::page_size, verified) == fused::status::error);
+
+        uint32_t result = 0;
+        test::check(!verified.check(sim::base, data.size(), data.data(), result));
+    }
+
+    /**
+     * @brief Program and verify 16 KiB and return the cycles it took
+     *
+     * @return uint64_t
+     */
+    static uint64_t measure() {
+        sim::reset();
+
+        const auto data = pattern(16 * 1024);
+        fused::record verified;
+        verified.clear();
+
+        test::check(fused::program<sim>(sim::base, data.size(), data.data(), sim::page_size, verified) == fused::status::ok);
+
+        uint32_t result = 0;
+        test::check(verified.check(sim::base, data.size(), data.data(), result) && result == sim::base + data.size());
+
+        return sim::time;
+    }
+
+    static uint64_t run() {
+        test_program();
+        test_mismatch();
+        test_program_error();
+
+        return measure();
+    }
+};
+
+int main() {
+    test_record();
+
+    constexpr uint32_t page_size = sim_device<false, 1>::page_size;
+
+    // no reads while programming, two banks of 8 KiB and every page
+    // readable while another page is programming
+    const uint64_t sequential = tests<false, 8 * 1024>::run();
+    const uint64_t dual_bank = tests<true, 8 * 1024>::run();
+    const uint64_t pipelined = tests<true, page_size>::run();
+
+    // time for programming without any verify
+    const uint64_t program = (16 * 1024 / page_size) * sim_device<false, 1>::program_time;
+
+    std::printf(
+        "program and verify 16 KiB: program only %llu cycles, sequential %llu cycles, "
+        "dual bank %llu cycles, every page readable %llu cycles\n",
+        static_cast<unsigned long long>(program), static_cast<unsigned long long>(sequential),
+        static_cast<unsigned long long>(dual_bank), static_cast<unsigned long long>(pipelined)
+    );
+
+    test::check(pipelined < dual_bank);
+    test::check(dual_bank < sequential);
+
+    return test::result();
+}
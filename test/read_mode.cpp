@@ -0,0 +1,210 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <array>
+
+#include "read_mode.hpp"
+#include "test.hpp"
+
+/**
+ * @brief Simulated QSPI controller with a command mode and a memory mapped
+ * mode. Every access adds the cpu cycles it would take to a counter.
+ *
+ * @details Cost model (in cpu cycles, cpu running at 2x the spi clock):
+ * - command mode: every command moves at most 16 bytes through the fifo.
+ *   A command costs the software setup and the instruction, address and
+ *   dummy phases. Every byte costs the quad transfer and a fifo pop
+ * - memory mapped mode: the controller fetches 32 byte lines. A line costs
+ *   the instruction, address and dummy phases and the quad transfer of the
+ *   line. Every word costs a single bus read
+ */
+struct sim_controller {
+    constexpr static uint32_t base = 0x90000000;
+
+    // cost model
+    constexpr static uint32_t switch_cost = 60;
+    constexpr static uint32_t fifo_size = 16;
+    constexpr static uint32_t command_cost = 60 + ((8 + 24 + 8) * 2);
+    constexpr static uint32_t command_byte_cost = (2 * 2) + 6;
+    constexpr static uint32_t line_size = 32;
+    constexpr static uint32_t line_cost = ((2 + 6 + 4) * 2) + ((line_size * 2) * 2);
+    constexpr static uint32_t mapped_word_cost = 1;
+
+    static inline std::array<uint8_t, 64 * 1024> flash;
+
+    // state of the hardware
+    static inline bool hardware_mapped;
+
+    // amount of cpu cycles spend
+    static inline uint64_t cycles;
+
+    static void command_mode() {
+        cycles += switch_cost;
+        hardware_mapped = false;
+    }
+
+    static void memory_mapped_mode() {
+        cycles += switch_cost;
+        hardware_mapped = true;
+    }
+
+    static bool read(const uint32_t address, const uint32_t size, uint8_t *const data) {
+        // commands only work in command mode
+        test::check(!hardware_mapped);
+
+        const uint32_t commands = (size + fifo_size - 1) / fifo_size;
+        cycles += (commands * command_cost) + (size * command_byte_cost);
+
+        std::memcpy(data, &flash[address - base], size);
+
+        return true;
+    }
+
+    static const volatile uint8_t* map(const uint32_t address, const uint32_t size) {
+        // direct access only works in memory mapped mode
+        test::check(hardware_mapped);
+
+        const uint32_t first = (address - base) / line_size;
+        const uint32_t last = (address - base + size + line_size - 1) / line_size;
+        cycles += ((last - first) * line_cost) + (((size + 3) / 4) * mapped_word_cost);
+
+        return &flash[address - base];
+    }
+};
+
+using mode = read_mode<sim_controller>;
+
+static void test_init() {
+    // verify and read use memory mapped mode
+    mode::init(3);
+    test::check(mode::is_mapped() && sim_controller::hardware_mapped);
+
+    mode::init(0);
+    test::check(mode::is_mapped() && sim_controller::hardware_mapped);
+
+    // erase and program use command mode
+    mode::init(1);
+    test::check(!mode::is_mapped() && !sim_controller::hardware_mapped);
+
+    mode::init(2);
+    test::check(!mode::is_mapped() && !sim_controller::hardware_mapped);
+
+    // switching back before a erase or program
+    mode::init(3);
+    mode::set(false);
+    test::check(!mode::is_mapped() && !sim_controller::hardware_mapped);
+}
+
+static void test_aborted_session() {
+    // a previous session left the controller memory mapped without
+    // running uninit. Init needs to recover from it
+    mode::init(2);
+    sim_controller::hardware_mapped = true;
+
+    mode::init(2);
+    test::check(!sim_controller::hardware_mapped);
+
+    // programming after the recovery should use commands
+    uint8_t data[4];
+    test::check(mode::read(sim_controller::base, sizeof(data), data));
+}
+
+static void test_read() {
+    alignas(uint32_t) uint8_t data[100];
+
+    for (const uint32_t function : {2, 3}) {
+        mode::init(function);
+
+        // aligned and unaligned reads
+        for (const uint32_t offset : {0, 1, 4, 7}) {
+            std::memset(data, 0, sizeof(data));
+
+            test::check(mode::read(sim_controller::base + offset, sizeof(data) - offset, &data[offset % 4]));
+            test::check(std::memcmp(&data[offset % 4], &sim_controller::flash[offset], sizeof(data) - offset) == 0);
+        }
+    }
+}
+
+static void test_compare() {
+    alignas(uint32_t) uint8_t data[256];
+    std::memcpy(data, &sim_controller::flash[0x100], sizeof(data));
+
+    for (const uint32_t function : {2, 3}) {
+        mode::init(function);
+
+        const uint32_t address = sim_controller::base + 0x100;
+
+        test::check(mode::compare(address, sizeof(data), data) == (address + sizeof(data)));
+
+        // mismatches in the middle of a word and at the end
+        for (const uint32_t offset : {0u, 37u, 255u}) {
+            data[offset] ^= 0x01;
+            test::check(mode::compare(address, sizeof(data), data) == (address + offset));
+            data[offset] ^= 0x01;
+        }
+    }
+}
+
+static void test_blank() {
+    // create a blank area
+    std::memset(&sim_controller::flash[0x1000], 0xff, 0x100);
+
+    for (const uint32_t function : {2, 3}) {
+        mode::init(function);
+
+        test::check(mode::blank(sim_controller::base + 0x1000, 0x100, 0xff));
+        test::check(mode::blank(sim_controller::base + 0x1001, 0xff, 0xff));
+        test::check(!mode::blank(sim_controller::base + 0x0fff, 0x100, 0xff));
+        test::check(!mode::blank(sim_controller::base + 0x1000, 0x101, 0xff));
+    }
+}
+
+/**
+ * @brief Read the full flash in 4 KiB chunks like the J-Link does and
+ * return the cycles it took
+ *
+ * @param function
+ * @return uint64_t
+ */
+static uint64_t measure(const uint32_t function) {
+    alignas(uint32_t) static std::array<uint8_t, 4096> buffer;
+
+    sim_controller::cycles = 0;
+    mode::init(function);
+
+    for (uint32_t i = 0; i < sim_controller::flash.size(); i += buffer.size()) {
+        test::check(mode::read(sim_controller::base + i, buffer.size(), buffer.data()));
+        test::check(std::memcmp(buffer.data(), &sim_controller::flash[i], buffer.size()) == 0);
+    }
+
+    mode::set(false);
+
+    return sim_controller::cycles;
+}
+
+int main() {
+    // fill the flash with a pattern
+    for (uint32_t i = 0; i < sim_controller::flash.size(); i++) {
+        sim_controller::flash[i] = static_cast<uint8_t>((i * 7) ^ (i >> 8));
+    }
+
+    test_init();
+    test_aborted_session();
+    test_read();
+    test_compare();
+    test_blank();
+
+    // read the full flash in both modes
+    const uint64_t command = measure(2);
+    const uint64_t mapped = measure(3);
+
+    std::printf(
+        "read %zu bytes: command mode %llu cycles, memory mapped %llu cycles (%.2fx)\n",
+        sim_controller::flash.size(), static_cast<unsigned long long>(command),
+        static_cast<unsigned long long>(mapped), static_cast<double>(command) / mapped
+    );
+
+    test::check(mapped < command);
+
+    return test::result();
+}
@@ -0,0 +1,36 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+#include <cstdio>
+#include <source_location>
+
+namespace test {
+    // amount of checks that failed
+    inline int failures = 0;
+
+    /**
+     * @brief Check a condition and print the location when it fails
+     * 
+     * @param condition 
+     * @param location 
+     */
+    inline void check(const bool condition, const std::source_location location = std::source_location::current()) {
+        if (condition) {
+            return;
+        }
+
+        failures++;
+        std::printf("%s:%u: check failed\n", location.file_name(), location.line());
+    }
+
+    /**
+     * @brief Get the exit code of the test
+     * 
+     * @return int 
+     */
+    inline int result() {
+        return failures ? 1 : 0;
+    }
+}
+
+#endif